@@ -12,9 +12,20 @@
     # Source and output
     SOURCE="midi_clock_sync.cpp"
     OUTPUT="midi_clock_sync"
+    TUNER_SOURCE="midi_clock_tune.cpp"
+    TUNER_OUTPUT="midi_clock_tune"
+    BENCH_SOURCE="midi_clock_bench.cpp"
+    BENCH_OUTPUT="midi_clock_bench"
 
     # Compile
     $CXX $CXXFLAGS $SOURCE -o $OUTPUT $LDFLAGS
+    $CXX $CXXFLAGS $TUNER_SOURCE -o $TUNER_OUTPUT $LDFLAGS
+
+    # Benchmarks and kernel checks only on request: ./build.sh bench
+    if [ "$1" = "bench" ]; then
+        $CXX $CXXFLAGS $BENCH_SOURCE -o $BENCH_OUTPUT $LDFLAGS
+        echo "Benchmark built: ./$BENCH_OUTPUT"
+    fi
 
     if [ $? -eq 0 ]; then
         echo "â Build complete: $OUTPUT"
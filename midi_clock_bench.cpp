@@ -0,0 +1,351 @@
+// Benchmarks and self-checks for midi_clock_sync's tempo path
+//
+// Built from the bridge source the same way as midi_clock_tune, so what is
+// measured is the code that ships:
+//   - the regression kernels (scalar, SSE2, AVX2) must agree on the fitted
+//     tempo; the exit status is 1 if they do not
+//   - cost of a full refit per kernel against a scalar incremental fit
+//     (running sums, one add and one evict per pulse) for windows of 96 to
+//     8192 pulses, and the precision of both against a long double fit
+//   - per-pulse cost of every tempo pipeline (TEMPO_PIPELINES) on a
+//     synthetic jittered 24 PPQN clock, fed in batches like the ALSA loop
+//   - handover from analog pulses at 48/96 PPQN to 24 PPQN MIDI clock must
+//     re-anchor; the exit status is 1 if the first MIDI quarter is mistimed
+//
+//   ./build.sh bench && ./midi_clock_bench
+//
+// Tempo state is per-thread in this build, as in the tuner, so absolute
+// figures include one thread-local access per field; compare columns.
+#define MIDI_CLOCK_TUNER
+#include "midi_clock_sync.cpp"
+
+#include <random>
+
+// ============================================================================
+// CONFIGURATION
+// ============================================================================
+constexpr int BENCH_WINDOWS[] = {96, 192, 384, 768, 1536, 2048, 4096, 8192};
+constexpr double BENCH_BPM = 120.0005;          // Off-grid, so rounding cannot hide errors
+constexpr double BENCH_JITTER_US = 150.0;       // Gaussian pulse jitter (1 sigma)
+constexpr double BENCH_KERNEL_TOLERANCE_BPM = 1e-9;
+constexpr long BENCH_REFIT_PULSES = 20000000;   // Pulses refitted per kernel and window
+constexpr int BENCH_INCREMENTAL_QUARTERS = 2000000;
+constexpr int BENCH_PRECISION_MINUTES = 60;
+constexpr int BENCH_PIPELINE_BATCH = 64;        // Pulses per call, as EVENT_BATCH_SIZE
+constexpr int BENCH_PIPELINE_BATCHES = 200000;
+constexpr double BENCH_PIPELINE_JITTER_US = 100.0;
+constexpr double BENCH_HANDOVER_ANALOG_BPM = 120.0;
+constexpr double BENCH_HANDOVER_MIDI_BPM = 100.0;
+constexpr int BENCH_HANDOVER_BATCH = 5;         // MIDI pulses per call
+
+// Result sink, so the optimiser cannot drop the timed calls
+volatile double g_bench_sink = 0.0;
+
+// ============================================================================
+// INCREMENTAL REFERENCE
+// ============================================================================
+// The straightforward alternative to refitting: running sums updated with
+// the newest pulse and the evicted one, slope from the textbook formula.
+// O(1) per pulse, but the sums of squares cancel catastrophically once the
+// window is long and the times large.
+struct IncrementalRegression {
+    std::vector<double> xs, ys;
+    int capacity;
+    int head = 0;
+    int count = 0;
+    double sx = 0.0, sy = 0.0, sxy = 0.0, sxx = 0.0;
+    
+    explicit IncrementalRegression(int n) : xs(n), ys(n), capacity(n) {}
+    
+    void push(double x, double y) {
+        if (count == capacity) {
+            double ox = xs[head], oy = ys[head];
+            sx -= ox;
+            sy -= oy;
+            sxy -= ox * oy;
+            sxx -= ox * ox;
+        } else {
+            count++;
+        }
+        xs[head] = x;
+        ys[head] = y;
+        sx += x;
+        sy += y;
+        sxy += x * y;
+        sxx += x * x;
+        head = head + 1 < capacity ? head + 1 : 0;
+    }
+    
+    double slope() const {
+        double n = count;
+        return (sxy - sx * sy / n) / (sxx - sx * sx / n);
+    }
+};
+
+long double exact_slope(const double* x, const double* y, int n) {
+    long double mx = 0.0L, my = 0.0L;
+    for (int i = 0; i < n; i++) {
+        mx += x[i];
+        my += y[i];
+    }
+    mx /= n;
+    my /= n;
+    
+    long double sxy = 0.0L, sxx = 0.0L;
+    for (int i = 0; i < n; i++) {
+        long double dx = x[i] - mx;
+        sxy += dx * (y[i] - my);
+        sxx += dx * dx;
+    }
+    return sxy / sxx;
+}
+
+// ============================================================================
+// REGRESSION KERNELS
+// ============================================================================
+struct SlopeKernel {
+    const char* name;
+    double (*fit)(const double* x, const double* y, int n);
+};
+
+std::vector<SlopeKernel> available_kernels() {
+    std::vector<SlopeKernel> kernels = {{"scalar", fit_slope_scalar}};
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) kernels.push_back({"sse2", fit_slope_sse2});
+    if (__builtin_cpu_supports("avx2")) kernels.push_back({"avx2", fit_slope_avx2});
+#endif
+    return kernels;
+}
+
+// A jittered 24 PPQN pulse train as the estimator's window holds it
+void fill_window(RegressionWindow& window, int n, std::mt19937& rng, uint64_t start_us) {
+    std::normal_distribution<double> jitter(0.0, BENCH_JITTER_US);
+    double period = 60000000.0 / BENCH_BPM / PULSES_PER_QUARTER;
+    window.capacity = n;
+    window.clear();
+    for (int i = 0; i < n; i++) {
+        window.push((uint64_t)(start_us + i * period + jitter(rng)), PULSES_PER_QUARTER);
+    }
+}
+
+// Every kernel on every window size, starting near zero and at a present-day
+// Unix time in microseconds; all must give the same tempo
+bool check_kernels(const std::vector<SlopeKernel>& kernels) {
+    std::cout << "[BENCH] Kernel agreement (max |BPM difference| from scalar)" << std::endl;
+    std::mt19937 rng(1);
+    bool ok = true;
+    
+    for (const SlopeKernel& kernel : kernels) {
+        double worst = 0.0;
+        for (int n : BENCH_WINDOWS) {
+            for (uint64_t start_us : {(uint64_t)1000000, (uint64_t)1700000000000000ULL}) {
+                for (int trial = 0; trial < 8; trial++) {
+                    fill_window(g_regression, n - trial, rng, start_us);
+                    const double* x = g_regression.newest_beats();
+                    const double* y = g_regression.newest_times();
+                    int count = g_regression.count;
+                    double reference = 60000000.0 / fit_slope_scalar(x, y, count);
+                    worst = std::max(worst, std::abs(60000000.0 / kernel.fit(x, y, count) - reference));
+                }
+            }
+        }
+        bool agrees = worst <= BENCH_KERNEL_TOLERANCE_BPM;
+        ok = ok && agrees;
+        std::cout << "  " << std::setw(8) << std::left << kernel.name << std::scientific
+                  << std::setprecision(2) << worst << " BPM" << (agrees ? "" : "  MISMATCH") << std::endl;
+    }
+    std::cout << std::defaultfloat;
+    return ok;
+}
+
+// Cost of one full refit per kernel, and of one quarter note (24 pushes and
+// a slope) for the incremental fit, per window size
+void bench_refits(const std::vector<SlopeKernel>& kernels) {
+    std::cout << "\n[BENCH] Refit cost (ns per refit; incremental: ns per quarter note)" << std::endl;
+    std::cout << "  window";
+    for (const SlopeKernel& kernel : kernels) std::cout << std::setw(10) << std::right << kernel.name;
+    std::cout << std::setw(13) << std::right << "incremental" << std::endl;
+    
+    std::mt19937 rng(2);
+    double period = 60000000.0 / BENCH_BPM / PULSES_PER_QUARTER;
+    for (int n : BENCH_WINDOWS) {
+        fill_window(g_regression, n, rng, 1000000);
+        const double* x = g_regression.newest_beats();
+        const double* y = g_regression.newest_times();
+        
+        std::cout << "  " << std::setw(6) << std::right << n << std::fixed << std::setprecision(0);
+        for (const SlopeKernel& kernel : kernels) {
+            long reps = BENCH_REFIT_PULSES / n;
+            auto start = std::chrono::steady_clock::now();
+            for (long r = 0; r < reps; r++) {
+                g_bench_sink = g_bench_sink + kernel.fit(x, y, n);
+            }
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            std::cout << std::setw(10) << ns / reps;
+        }
+        
+        IncrementalRegression incremental(n);
+        for (int i = 0; i < n; i++) incremental.push(x[i], y[i]);
+        double beat = x[n - 1], time = y[n - 1];
+        auto start = std::chrono::steady_clock::now();
+        for (int q = 0; q < BENCH_INCREMENTAL_QUARTERS; q++) {
+            for (int p = 0; p < PULSES_PER_QUARTER; p++) {
+                beat += 1.0 / PULSES_PER_QUARTER;
+                time += period;
+                incremental.push(beat, time);
+            }
+            g_bench_sink = g_bench_sink + incremental.slope();
+        }
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        std::cout << std::setprecision(1) << std::setw(13) << ns / BENCH_INCREMENTAL_QUARTERS << std::endl;
+    }
+    std::cout << std::defaultfloat;
+}
+
+// An hour of jittered clock: worst tempo error of the refit and of the
+// incremental fit against a long double fit of the same window
+void bench_precision() {
+    std::cout << "\n[BENCH] Precision over " << BENCH_PRECISION_MINUTES
+              << " min (max |BPM error| vs long double fit)" << std::endl;
+    std::cout << "  window       refit  incremental" << std::endl;
+    
+    std::mt19937 rng(3);
+    std::normal_distribution<double> jitter(0.0, BENCH_JITTER_US);
+    double period = 60000000.0 / BENCH_BPM / PULSES_PER_QUARTER;
+    long pulses = (long)(BENCH_BPM * BENCH_PRECISION_MINUTES * PULSES_PER_QUARTER);
+    
+    for (int n : {REGRESSION_WINDOW_MIN, DEFAULT_REGRESSION_WINDOW, REGRESSION_WINDOW_MAX}) {
+        g_regression.capacity = n;
+        g_regression.clear();
+        IncrementalRegression incremental(n);
+        double refit_error = 0.0, incremental_error = 0.0;
+        
+        for (long i = 0; i < pulses; i++) {
+            uint64_t ts = (uint64_t)(1000000.0 + i * period + jitter(rng));
+            g_regression.push(ts, PULSES_PER_QUARTER);
+            incremental.push((double)i / PULSES_PER_QUARTER, (double)(ts - g_regression.anchor_us));
+            if (i < n || i % PULSES_PER_QUARTER != 0) continue;
+            
+            const double* x = g_regression.newest_beats();
+            const double* y = g_regression.newest_times();
+            double exact = 60000000.0 / (double)exact_slope(x, y, n);
+            refit_error = std::max(refit_error, std::abs(60000000.0 / g_fit_slope(x, y, n) - exact));
+            incremental_error = std::max(incremental_error, std::abs(60000000.0 / incremental.slope() - exact));
+        }
+        std::cout << "  " << std::setw(6) << n << std::scientific << std::setprecision(2)
+                  << std::setw(12) << refit_error << std::setw(13) << incremental_error << std::endl;
+    }
+    std::cout << std::defaultfloat;
+}
+
+// ============================================================================
+// PULSE SOURCE HANDOVER
+// ============================================================================
+// Analog edges stop part-way through a quarter at a finer resolution, then
+// MIDI clock takes over in small batches. The first MIDI quarter must be
+// timed from the first MIDI pulse, not from an analog edge or a pulse count
+// carried over from the analog input.
+bool check_pulse_handover() {
+    std::cout << "\n[BENCH] Analog to MIDI clock handover (first MIDI quarter)" << std::endl;
+    bool ok = true;
+    
+    for (int analog_ppq : {48, 96}) {
+        // The bridge's own [PULSE]/[MIDI] messages are not part of the report
+        std::ostringstream bridge_log;
+        std::streambuf* report = std::cout.rdbuf(bridge_log.rdbuf());
+        reset_estimator();
+        g_bpm_state.pulse_source = PULSE_SOURCE_NONE;
+        g_analog.last_pulse_us = 0;
+        g_config.pulse_ppqn = analog_ppq;
+        
+        // Four quarters and five sixths of another, so the count is left past 24
+        double t = 1000000.0;
+        double analog_period = 60000000.0 / BENCH_HANDOVER_ANALOG_BPM / analog_ppq;
+        int edges = analog_ppq * 4 + analog_ppq * 5 / 6;
+        for (int i = 0; i < edges; i++) {
+            g_analog.edges.push((uint64_t)t);
+            t += analog_period;
+            if (i % 32 == 31) process_analog_pulses();
+        }
+        process_analog_pulses();
+        int analog_count = g_bpm_state.pulse_count.load();
+        
+        double midi_period = 60000000.0 / BENCH_HANDOVER_MIDI_BPM / PULSES_PER_QUARTER;
+        uint64_t batch[BENCH_HANDOVER_BATCH];
+        for (int sent = 0; sent < PULSES_PER_QUARTER + 1; sent += BENCH_HANDOVER_BATCH) {
+            for (int j = 0; j < BENCH_HANDOVER_BATCH; j++) {
+                batch[j] = (uint64_t)t;
+                t += midi_period;
+            }
+            process_midi_pulses(batch, BENCH_HANDOVER_BATCH);
+        }
+        std::cout.rdbuf(report);
+        
+        double raw = g_bpm_state.last_raw_bpm.load();
+        bool handed_over = std::abs(raw - BENCH_HANDOVER_MIDI_BPM) < 0.01 &&
+                           g_bpm_state.pulse_count.load() < PULSES_PER_QUARTER;
+        ok = ok && handed_over;
+        std::cout << "  " << std::setw(3) << std::right << analog_ppq << " PPQN (count " << analog_count << "): "
+                  << std::fixed << std::setprecision(3) << raw << " BPM"
+                  << (handed_over ? "" : "  WRONG") << std::endl;
+    }
+    std::cout << std::defaultfloat;
+    return ok;
+}
+
+// ============================================================================
+// TEMPO PIPELINES
+// ============================================================================
+// The same pulse train through each pipeline from a cold start, so the cost
+// includes acquiring and locking as well as the locked steady state
+void bench_pipelines() {
+    std::cout << "\n[BENCH] Tempo pipelines (" << PULSES_PER_QUARTER << " PPQN at "
+              << std::fixed << std::setprecision(4) << BENCH_BPM << " BPM, " << BENCH_PIPELINE_BATCH << " pulses per batch)" << std::endl;
+    std::cout << "  pipeline            ns/pulse  final BPM" << std::endl;
+    
+    std::mt19937 rng(4);
+    std::normal_distribution<double> jitter(0.0, BENCH_PIPELINE_JITTER_US);
+    double period = 60000000.0 / BENCH_BPM / PULSES_PER_QUARTER;
+    std::vector<uint64_t> pulses((size_t)BENCH_PIPELINE_BATCH * BENCH_PIPELINE_BATCHES);
+    for (size_t i = 0; i < pulses.size(); i++) {
+        pulses[i] = (uint64_t)(1000000.0 + i * period + jitter(rng));
+    }
+    
+    for (const TempoPipeline& pipeline : TEMPO_PIPELINES) {
+        reset_estimator();
+        g_bpm_state.outlier_run = 0;
+        g_regression.capacity = g_config.regression_window;
+        g_regression.clear();
+        
+        auto start = std::chrono::steady_clock::now();
+        for (int b = 0; b < BENCH_PIPELINE_BATCHES; b++) {
+            pipeline.process_pulses(&pulses[(size_t)b * BENCH_PIPELINE_BATCH], BENCH_PIPELINE_BATCH,
+                                    PULSES_PER_QUARTER);
+        }
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "  " << std::setw(20) << std::left << pipeline.name << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(8) << ns / pulses.size()
+                  << std::setprecision(3) << std::setw(11) << g_bpm_state.current_bpm.load() << std::endl;
+    }
+    std::cout << std::defaultfloat;
+}
+
+// ============================================================================
+// MAIN
+// ============================================================================
+int main() {
+    std::vector<SlopeKernel> kernels = available_kernels();
+    select_regression_kernel();
+    std::cout << "[BENCH] Kernels: ";
+    for (const SlopeKernel& kernel : kernels) std::cout << kernel.name << " ";
+    std::cout << "(estimator uses " << g_regression.kernel_name << ")\n" << std::endl;
+    
+    bool ok = check_kernels(kernels);
+    ok = check_pulse_handover() && ok;
+    bench_refits(kernels);
+    bench_precision();
+    bench_pipelines();
+    
+    return ok ? 0 : 1;
+}
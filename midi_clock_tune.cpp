@@ -0,0 +1,485 @@
+// Offline estimator tuner for midi_clock_sync
+//
+// Replays recorded clock streams (midi_clock_sync --record) through the
+// bridge's own tempo path under every configuration of a search space,
+// ranks the configurations and writes the best one as a file the bridge
+// loads with --config. The bridge source is compiled in with its tempo
+// state made per-thread, so what is tuned is exactly what ships.
+#define MIDI_CLOCK_TUNER
+#include "midi_clock_sync.cpp"
+
+#include <dirent.h>
+#include <deque>
+
+// ============================================================================
+// CONFIGURATION
+// ============================================================================
+constexpr double TUNE_LOCK_REF_US = 1000000.0;  // Score: 1 s to first lock ...
+constexpr double TUNE_JITTER_REF_BPM = 0.05;    // ... 0.05 BPM RMS tempo steps ...
+constexpr double TUNE_PHASE_REF_TICKS = 10.0;   // ... and 10 ticks RMS phase slip weigh the same
+constexpr uint64_t TUNE_GAP_US = 1000000;       // A longer pause in the clock starts a new segment
+constexpr int TUNE_DEFAULT_TOP = 10;
+constexpr const char* TUNE_DEFAULT_OUTPUT = "midi_clock_sync.conf";
+
+// A recorded clock stream (see record_event())
+struct Recording {
+    std::string name;
+    int ppq = PULSES_PER_QUARTER;
+    std::vector<uint64_t> times;
+    std::vector<uint8_t> status;
+};
+
+// One point of the search space: options as they appear in a config file
+struct Candidate {
+    std::vector<std::pair<std::string, std::string>> options;   // Empty value = flag
+};
+
+struct ReplayResult {
+    bool locked = false;
+    double lock_us = 0.0;       // Stream time from the first clock to the first lock
+    double jitter_bpm = 0.0;    // RMS change of the output tempo per quarter note once locked
+    double phase_ticks = 0.0;   // RMS phase slip over PHASE_CORRECTION_BEATS at the output tempo
+    int relocks = 0;            // Lock transitions after the first lock
+    
+    double score() const {
+        return lock_us / TUNE_LOCK_REF_US + jitter_bpm / TUNE_JITTER_REF_BPM +
+               phase_ticks / TUNE_PHASE_REF_TICKS;
+    }
+};
+
+struct RankedCandidate {
+    int index = 0;
+    ReplayResult mean;
+    double score = 0.0;
+    int unlocked = 0;           // Recordings it never locked on
+};
+
+struct TuneOptions {
+    std::string recordings;
+    std::string space;
+    std::string output = TUNE_DEFAULT_OUTPUT;
+    int threads = 0;            // 0 = all cores
+    int top = TUNE_DEFAULT_TOP;
+};
+
+// ============================================================================
+// RECORDINGS AND SEARCH SPACE
+// ============================================================================
+bool load_recording(const std::string& path, Recording& rec) {
+    std::ifstream file(path);
+    if (!file) return false;
+    
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty()) continue;
+        if (line[0] == '#') {
+            std::sscanf(line.c_str(), "# ppqn %d", &rec.ppq);
+            continue;
+        }
+        unsigned long long ts;
+        unsigned int status;
+        if (std::sscanf(line.c_str(), "%llu %x", &ts, &status) != 2) continue;
+        rec.times.push_back(ts);
+        rec.status.push_back((uint8_t)status);
+    }
+    return rec.ppq > 0 && !rec.times.empty();
+}
+
+bool load_recordings(const std::string& dir_path, std::vector<Recording>& recordings) {
+    DIR* dir = opendir(dir_path.c_str());
+    if (!dir) {
+        std::cerr << "[ERROR] Cannot open recordings directory: " << dir_path << std::endl;
+        return false;
+    }
+    
+    std::vector<std::string> names;
+    while (dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    
+    for (const std::string& name : names) {
+        Recording rec;
+        rec.name = name;
+        if (!load_recording(dir_path + "/" + name, rec)) {
+            std::cerr << "[TUNE] Skipping " << name << ": no clock events" << std::endl;
+            continue;
+        }
+        std::cout << "[TUNE] " << name << ": " << rec.times.size() << " events, "
+                  << rec.ppq << " PPQN, " << std::fixed << std::setprecision(1)
+                  << (rec.times.back() - rec.times.front()) / 1e6 << " s" << std::endl;
+        recordings.push_back(std::move(rec));
+    }
+    return !recordings.empty();
+}
+
+// One option per line followed by its candidate values, e.g.
+//   smoothing 0.1 0.2 0.3
+//   lock-enter 0.25:2 0.15:3
+//   outlier-filter off on
+// Flags take on/off. Every combination is tried.
+bool load_search_space(const std::string& path, std::vector<Candidate>& candidates) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "[ERROR] Cannot open search space: " << path << std::endl;
+        return false;
+    }
+    
+    candidates.assign(1, Candidate());
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string key, value;
+        if (!(iss >> key) || key[0] == '#') continue;
+        
+        std::vector<Candidate> expanded;
+        while (iss >> value) {
+            for (const Candidate& base : candidates) {
+                Candidate c = base;
+                if (value == "on") {
+                    c.options.push_back({key, ""});
+                } else if (value != "off") {
+                    c.options.push_back({key, value});
+                }
+                expanded.push_back(std::move(c));
+            }
+        }
+        if (expanded.empty()) {
+            std::cerr << "[ERROR] No values for " << key << " in " << path << std::endl;
+            return false;
+        }
+        candidates = std::move(expanded);
+    }
+    return true;
+}
+
+std::string describe_candidate(const Candidate& candidate) {
+    std::string out;
+    for (const auto& option : candidate.options) {
+        if (!out.empty()) out += " ";
+        out += option.first;
+        if (!option.second.empty()) out += " " + option.second;
+    }
+    return out.empty() ? "(defaults)" : out;
+}
+
+// Sets this thread's options to the candidate and returns its pipeline
+const TempoPipeline* apply_candidate(const Candidate& candidate) {
+    g_config = Config();
+    g_snap = SnapPolicy();
+    
+    std::vector<std::string> args = {"midi_clock_tune"};
+    for (const auto& option : candidate.options) {
+        args.push_back("--" + option.first);
+        if (!option.second.empty()) args.push_back(option.second);
+    }
+    std::vector<char*> argv;
+    for (std::string& arg : args) argv.push_back(&arg[0]);
+    if (!parse_arguments((int)argv.size(), argv.data())) return nullptr;
+    
+    g_regression.capacity = g_config.regression_window;
+    std::string name = g_config.estimator + (g_config.outlier_filter ? "+outlier" : "");
+    for (const TempoPipeline& pipeline : TEMPO_PIPELINES) {
+        if (name == pipeline.name) return &pipeline;
+    }
+    return nullptr;
+}
+
+// ============================================================================
+// REPLAY
+// ============================================================================
+// Feeds the recording pulse by pulse, as the bridge sees a live clock, and
+// measures what a follower of the output tempo would experience
+ReplayResult replay_recording(const Recording& rec, const TempoPipeline& pipeline) {
+    reset_estimator();
+    g_lock.transitions.store(0);
+    g_lock.acquire_start_us = 0;
+    g_lock.time_to_lock_us.store(-1);
+    g_bpm_state.outlier_run = 0;
+    g_bpm_state.start_armed.store(false);
+    
+    ReplayResult result;
+    uint64_t first_us = 0, prev_us = 0;
+    int last_count = 0, lock_transitions = 0;
+    double output_bpm = 0.0;
+    double jitter_sum = 0.0, phase_sum = 0.0;
+    int jitter_n = 0, phase_n = 0;
+    double phase_beats = 0.0;
+    int phase_pulses = 0;
+    const int phase_window = (int)(PHASE_CORRECTION_BEATS * rec.ppq);
+    
+    for (size_t i = 0; i < rec.times.size(); i++) {
+        uint64_t ts = rec.times[i];
+        if (rec.status[i] != 0xF8) {
+            // START/CONTINUE re-anchor the count, as the armed start does live
+            if (rec.status[i] != 0xFC) g_bpm_state.first_clock_received.store(false);
+            continue;
+        }
+        if (first_us == 0) first_us = ts;
+        if (prev_us != 0 && ts - prev_us > TUNE_GAP_US) {
+            g_bpm_state.first_clock_received.store(false);
+            phase_beats = 0.0;
+            phase_pulses = 0;
+        } else if (result.locked && prev_us != 0) {
+            // Where a follower running at the output tempo would be
+            phase_beats += output_bpm * (ts - prev_us) / 60000000.0;
+            if (++phase_pulses == phase_window) {
+                double slip = (phase_beats - PHASE_CORRECTION_BEATS) * TICKS_PER_BEAT;
+                phase_sum += slip * slip;
+                phase_n++;
+                phase_beats = 0.0;
+                phase_pulses = 0;
+            }
+        }
+        prev_us = ts;
+        
+        pipeline.process_pulses(&ts, 1, rec.ppq);
+        
+        int count = g_bpm_state.measurement_count.load();
+        if (count == last_count) continue;
+        last_count = count;
+        
+        double bpm = g_bpm_state.current_bpm.load();
+        if (!result.locked && g_lock.state.load() == LOCK_LOCKED) {
+            result.locked = true;
+            result.lock_us = (double)(ts - first_us);
+            lock_transitions = g_lock.transitions.load();
+        } else if (result.locked) {
+            double step = bpm - output_bpm;
+            jitter_sum += step * step;
+            jitter_n++;
+        }
+        output_bpm = bpm;
+    }
+    
+    if (!result.locked) {
+        result.lock_us = (double)(prev_us - first_us);
+        return result;
+    }
+    result.jitter_bpm = jitter_n > 0 ? std::sqrt(jitter_sum / jitter_n) : 0.0;
+    result.phase_ticks = phase_n > 0 ? std::sqrt(phase_sum / phase_n) : 0.0;
+    result.relocks = g_lock.transitions.load() - lock_transitions;
+    return result;
+}
+
+// ============================================================================
+// WORK-STEALING POOL
+// ============================================================================
+// Every (candidate, recording) pair is one task. Each worker owns a deque
+// and takes from its back; when it runs dry it steals from the front of the
+// others. Replays differ in length by orders of magnitude, so a static split
+// would leave cores idle behind the longest recordings.
+struct Task {
+    int candidate;
+    int recording;
+};
+
+struct WorkQueue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+};
+
+bool next_task(std::vector<WorkQueue>& queues, int self, Task& task) {
+    {
+        std::lock_guard<std::mutex> lock(queues[self].mutex);
+        if (!queues[self].tasks.empty()) {
+            task = queues[self].tasks.back();
+            queues[self].tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t k = 1; k < queues.size(); k++) {
+        WorkQueue& victim = queues[(self + k) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void run_tuning(const std::vector<Candidate>& candidates, const std::vector<Recording>& recordings,
+                int nthreads, std::vector<std::vector<ReplayResult>>& results) {
+    results.assign(candidates.size(), std::vector<ReplayResult>(recordings.size()));
+    
+    // Candidate-major, so a worker mostly stays on one configuration
+    std::vector<WorkQueue> queues(nthreads);
+    for (size_t c = 0; c < candidates.size(); c++) {
+        for (size_t r = 0; r < recordings.size(); r++) {
+            queues[c % nthreads].tasks.push_back({(int)c, (int)r});
+        }
+    }
+    
+    std::atomic<int> done{0};
+    const int total = (int)(candidates.size() * recordings.size());
+    std::vector<std::thread> workers;
+    for (int w = 0; w < nthreads; w++) {
+        workers.emplace_back([&, w] {
+            Task task;
+            int applied = -1;
+            const TempoPipeline* pipeline = nullptr;
+            while (next_task(queues, w, task)) {
+                if (task.candidate != applied) {
+                    pipeline = apply_candidate(candidates[task.candidate]);
+                    applied = task.candidate;
+                }
+                results[task.candidate][task.recording] = replay_recording(recordings[task.recording], *pipeline);
+                int finished = ++done;
+                if (w == 0 && finished % 64 == 0) {
+                    std::cerr << "\r[TUNE] " << finished << "/" << total << " replays" << std::flush;
+                }
+            }
+        });
+    }
+    for (std::thread& worker : workers) worker.join();
+    std::cerr << "\r[TUNE] " << total << "/" << total << " replays" << std::endl;
+}
+
+// ============================================================================
+// RANKING AND OUTPUT
+// ============================================================================
+std::vector<RankedCandidate> rank_candidates(const std::vector<std::vector<ReplayResult>>& results) {
+    std::vector<RankedCandidate> ranked;
+    for (size_t c = 0; c < results.size(); c++) {
+        RankedCandidate rc;
+        rc.index = (int)c;
+        double n = (double)results[c].size();
+        for (const ReplayResult& r : results[c]) {
+            rc.mean.lock_us += r.lock_us / n;
+            rc.mean.jitter_bpm += r.jitter_bpm / n;
+            rc.mean.phase_ticks += r.phase_ticks / n;
+            rc.mean.relocks += r.relocks;
+            rc.score += r.score() / n;
+            if (!r.locked) rc.unlocked++;
+        }
+        ranked.push_back(rc);
+    }
+    // Locking on every recording comes first, then the combined score
+    std::stable_sort(ranked.begin(), ranked.end(), [](const RankedCandidate& a, const RankedCandidate& b) {
+        if (a.unlocked != b.unlocked) return a.unlocked < b.unlocked;
+        return a.score < b.score;
+    });
+    return ranked;
+}
+
+void print_ranking(const std::vector<RankedCandidate>& ranked, const std::vector<Candidate>& candidates,
+                   int top) {
+    std::cout << "\n rank   score   lock ms  jitter BPM  phase ticks  relocks  unlocked  options" << std::endl;
+    for (int i = 0; i < (int)ranked.size() && i < top; i++) {
+        const RankedCandidate& rc = ranked[i];
+        std::cout << std::right << std::setw(5) << i + 1 << std::fixed
+                  << std::setprecision(3) << std::setw(8) << rc.score
+                  << std::setprecision(0) << std::setw(10) << rc.mean.lock_us / 1000.0
+                  << std::setprecision(4) << std::setw(12) << rc.mean.jitter_bpm
+                  << std::setprecision(2) << std::setw(13) << rc.mean.phase_ticks
+                  << std::setw(9) << rc.mean.relocks << std::setw(10) << rc.unlocked
+                  << "  " << describe_candidate(candidates[rc.index]) << std::endl;
+    }
+}
+
+bool write_config(const std::string& path, const RankedCandidate& best, const Candidate& candidate,
+                  size_t ncandidates, size_t nrecordings) {
+    std::ofstream file(path);
+    if (!file) return false;
+    
+    file << "# midi_clock_tune: best of " << ncandidates << " configurations over "
+         << nrecordings << " recordings" << std::endl;
+    file << "# score " << std::fixed << std::setprecision(3) << best.score
+         << ", lock " << std::setprecision(0) << best.mean.lock_us / 1000.0 << " ms"
+         << ", jitter " << std::setprecision(4) << best.mean.jitter_bpm << " BPM"
+         << ", phase " << std::setprecision(2) << best.mean.phase_ticks << " ticks" << std::endl;
+    file << "# Load with: midi_clock_sync --config " << path << std::endl;
+    for (const auto& option : candidate.options) {
+        file << option.first;
+        if (!option.second.empty()) file << " " << option.second;
+        file << std::endl;
+    }
+    return (bool)file;
+}
+
+// ============================================================================
+// MAIN
+// ============================================================================
+void print_tune_usage(const char* prog) {
+    std::cout << "[INFO] Usage: " << prog << " [options] <recordings dir> <search space file>" << std::endl;
+    std::cout << "  Example: " << prog << " -o tuned.conf recordings/ space.txt" << std::endl;
+    std::cout << "  Options:" << std::endl;
+    std::cout << "    -j <threads>            Worker threads (default: all cores)" << std::endl;
+    std::cout << "    -o <file>               Config file for the best configuration (default "
+              << TUNE_DEFAULT_OUTPUT << ")" << std::endl;
+    std::cout << "    --top <n>               Configurations to list (default " << TUNE_DEFAULT_TOP << ")" << std::endl;
+}
+
+bool parse_tune_arguments(int argc, char* argv[], TuneOptions& opts) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "-j" && has_value) {
+            opts.threads = std::atoi(argv[++i]);
+        } else if (arg == "-o" && has_value) {
+            opts.output = argv[++i];
+        } else if (arg == "--top" && has_value) {
+            opts.top = std::atoi(argv[++i]);
+        } else if (arg == "-h" || arg == "--help") {
+            print_tune_usage(argv[0]);
+            std::exit(0);
+        } else if (arg[0] == '-') {
+            std::cerr << "[ERROR] Unknown option: " << arg << std::endl;
+            return false;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() != 2) return false;
+    opts.recordings = positional[0];
+    opts.space = positional[1];
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    TuneOptions opts;
+    if (!parse_tune_arguments(argc, argv, opts)) {
+        print_tune_usage(argv[0]);
+        return 1;
+    }
+    
+    std::vector<Recording> recordings;
+    std::vector<Candidate> candidates;
+    if (!load_recordings(opts.recordings, recordings) || !load_search_space(opts.space, candidates)) {
+        return 1;
+    }
+    
+    // Reject bad options here rather than in every worker
+    for (const Candidate& candidate : candidates) {
+        if (!apply_candidate(candidate)) {
+            std::cerr << "[ERROR] Invalid configuration: " << describe_candidate(candidate) << std::endl;
+            return 1;
+        }
+    }
+    select_regression_kernel();
+    
+    int nthreads = opts.threads > 0 ? opts.threads : (int)std::max(1u, std::thread::hardware_concurrency());
+    std::cout << "[TUNE] " << candidates.size() << " configurations x " << recordings.size()
+              << " recordings on " << nthreads << " threads" << std::endl;
+    
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::vector<ReplayResult>> results;
+    run_tuning(candidates, recordings, nthreads, results);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "[TUNE] Done in " << std::fixed << std::setprecision(2) << elapsed << " s" << std::endl;
+    
+    std::vector<RankedCandidate> ranked = rank_candidates(results);
+    print_ranking(ranked, candidates, opts.top);
+    
+    const RankedCandidate& best = ranked.front();
+    if (!write_config(opts.output, best, candidates[best.index], candidates.size(), recordings.size())) {
+        std::cerr << "[ERROR] Cannot write " << opts.output << std::endl;
+        return 1;
+    }
+    std::cout << "\n[TUNE] Best configuration written to " << opts.output << std::endl;
+    return 0;
+}